@@ -1,5 +1,7 @@
 #include <M5Stack.h>
 #include <BluetoothSerial.h>
+#include <esp_sleep.h>
+#include <driver/gpio.h>
 //#include <Free_Fonts.h>
 
 #define DEBUG
@@ -17,6 +19,44 @@
 #define PID_BATTERY_VOLTAGE "0142"
 #define PID_DTC_STATUS "0101"
 #define PID_VEHICLE_SPEED "010D"
+#define PID_SUPPORTED_01_20 "0100"
+#define PID_SUPPORTED_21_40 "0120"
+#define PID_SUPPORTED_41_60 "0140"
+
+//#define USE_HEADERS // ATH1: ogni riga di risposta riporta l'header della ECU che l'ha inviata
+#define MAX_ECUS 4
+#define ECU_TABLE_FULL -2  // splitHeader: riga con header ma nessuno slot ECU libero
+#define MAX_PIDS 16
+#define MAX_PID_MISSES 3
+#define PID_CACHE_DIR "/obd"
+#define PROFILE_DIR "/obd/profiles"
+#define DISCOVERY_RETRY_INTERVAL 5000  // ms minimi tra due tentativi di riconoscimento del veicolo
+
+// Gestione alimentazione
+#define CHARGING_VOLTAGE 13.2        // V, sopra questa soglia l'alternatore sta caricando
+#define WAKE_VOLTAGE_RISE 0.5        // V di aumento rispetto al riposo che fanno riprendere da parcheggiato
+#define ENGINE_OFF_DELAY 10000       // ms a motore spento prima di abbassare luminosità e frequenza di polling
+#define PARK_DELAY 120000            // ms a motore spento prima di mettere in low power ELM327 e ESP32
+#define ENGINE_DATA_TIMEOUT 5000     // ms senza risposte valide: l'RPM letto non è più attendibile
+#define VOLTAGE_STALE_TIME 3000      // ms oltre i quali la tensione viene riletta anche fuori dalla schermata principale
+#define PARKED_WAKE_INTERVAL 15000   // ms di light sleep (BT spento) tra due letture della tensione da parcheggiato
+#define ATLP_ENTRY_DELAY 1000        // ms tra l'OK di ATLP e l'effettivo standby dell'ELM327
+#define ELM_WAKE_DELAY 300           // ms concessi all'ELM327 per uscire dallo standby (warm start)
+#define PARKED_ATRV_TIMEOUT 300
+#define ENGINE_OFF_RPM_INTERVAL 1000 // ms tra due letture RPM a motore spento, su qualsiasi schermata
+#define RUNNING_QUERY_INTERVAL 250
+#define ENGINE_OFF_QUERY_INTERVAL 1000
+#define BRIGHTNESS_RUNNING 200
+#define BRIGHTNESS_ENGINE_OFF 40
+#define POWER_STATS_WINDOW 60000     // ms della finestra di media della corrente
+// Correnti stimate in mA (lato M5Stack a 5 V, lato ELM327 a 12 V)
+#define CURRENT_ESP_240MHZ 95.0
+#define CURRENT_ESP_80MHZ 50.0
+#define CURRENT_ESP_LIGHT_SLEEP 3.0
+#define CURRENT_BACKLIGHT_MAX 70.0
+#define CURRENT_ELM_ACTIVE 45.0
+#define CURRENT_ELM_LOW_POWER 12.0
+#define USB_TO_12V_FACTOR (5.0 / (12.0 * 0.85))  // Adattatore USB da accendisigari, rendimento ~85%
 
 #define m5Name "M5Stack_OBD"
 
@@ -49,14 +89,40 @@ void IRAM_ATTR indexDown();
 String readFromCircularBuffer(int numChars);
 String bufferSerialData(int timeout, int numChars);
 void parseOBDData(const String& response);
+void parseOBDLine(String line);
+void handleNoData();
+void handleNegativeResponse(const String& line);
+void countPIDMiss(bool unsupported);
+bool isTargetActive(float* value);
+int splitHeader(String& line);
+int findECU(uint32_t canId, uint8_t type);
+void resetECUs();
+void resetPIDTable();
+void identifyVehicle();
+int findPID(const char* cmd);
+bool isPIDSupported(int ecu, byte pid);
+void discoverSupportedPIDs();
+void assignPIDOwners();
+uint32_t requestHeaderFor(int ecu);
+void setRequestHeader(uint32_t header);
+bool requestDescriptor(int i);
+bool requestPID(const char* cmd);
+String readVIN();
+bool loadPIDCache();
+void savePIDCache();
+void loadVehicleProfile();
+
+void updatePowerState();
+void parkedCheck();
+bool lightSleep(unsigned long ms);
+void ELMstandby();
+void ELMwake();
+bool ELMrestore();
+void idleUntilNextPoll();
+float estimateCurrent(bool asleep);
+void accountCurrent(float mA, unsigned long ms);
+void updatePowerStats();
 
-float parseCoolantTemp(const String& response);
-float parseIntakeTemp(const String& response);
-float parseRPM(const String& response);
-float parseEngineLoad(const String& response);
-float parseOBDVoltage(const String& response);
-float parseMAF(const String& response);
-float parseBarometricPressure(const String& response);
 float parseOBDVoltage(const String& response);
 String parseDTCStatus(const String& response);
 
@@ -86,7 +152,25 @@ const unsigned long voltageQueryInterval = 1000; // Intervallo di 4 secondi
 
 unsigned long lastVoltageQueryTime = 0;
 unsigned long lastOBDQueryTime = 0;
-unsigned long OBDQueryInterval = 250; // Intervallo di query OBD in millisecondi
+unsigned long OBDQueryInterval = RUNNING_QUERY_INTERVAL; // Intervallo di query OBD in millisecondi
+
+enum PowerState { POWER_RUNNING, POWER_ENGINE_OFF, POWER_PARKED };
+PowerState powerState = POWER_RUNNING;
+unsigned long engineOffSince = 0;
+float parkedVoltage = 0.0;
+bool elmLowPower = false;     // Per la stima di corrente: ELM327 effettivamente in standby
+bool elmStandby = false;      // ATLP inviato e ELM327 non ancora risvegliato
+unsigned long lastRPMCheckTime = 0;
+void setPowerState(PowerState state);
+
+// Media della corrente stimata (mA*ms accumulati)
+double windowCharge = 0.0;
+unsigned long windowTime = 0;
+double totalCharge = 0.0;
+unsigned long totalTime = 0;
+unsigned long lastAccountTime = 0;
+unsigned long sleptSinceAccount = 0;
+float averageCurrent = 0.0;
 
 const int BUFFER_SIZE = 256;
 char circularBuffer[BUFFER_SIZE];
@@ -96,6 +180,77 @@ int screenIndex[5] = { 0, 1, 2, 3, 4 };
 int z = 1;
 int zLast = -1;
 
+// Formula lineare dei descrittori: valore = raw * scale + offset, raw = A, A*256+B o versione con segno
+enum PIDFormula : uint8_t { FORMULA_A, FORMULA_AB, FORMULA_SIGNED_A, FORMULA_SIGNED_AB };
+
+// Descrittore compatto di un PID: predefiniti e profili del veicolo usano lo stesso formato
+struct PIDDescriptor {
+  uint8_t mode;        // 0x01 o 0x22
+  uint16_t pid;
+  uint32_t header;     // header di richiesta, 0 = ECU proprietaria o broadcast
+  uint8_t formula;
+  float scale;
+  float offset;
+  uint16_t interval;   // ms minimi tra due richieste
+  float* value;        // variabile mostrata a video
+};
+
+const PIDDescriptor builtinPIDs[] = {
+  {0x01, 0x05, 0, FORMULA_A, 1.0, -40.0, 1000, &coolantTemp},
+  {0x01, 0x0F, 0, FORMULA_A, 1.0, -40.0, 2000, &intakeTemp},
+  {0x01, 0x0C, 0, FORMULA_AB, 0.25, 0.0, 250, &rpm},
+  {0x01, 0x04, 0, FORMULA_A, 100.0 / 255.0, 0.0, 250, &engineLoad},
+  {0x01, 0x10, 0, FORMULA_AB, 0.01, 0.0, 250, &MAF},
+  {0x01, 0x33, 0, FORMULA_A, 1.0, 0.0, 5000, &barometricPressure},
+};
+const int NUM_BUILTIN_PIDS = sizeof(builtinPIDs) / sizeof(builtinPIDs[0]);
+
+PIDDescriptor pidTable[MAX_PIDS];  // PID predefiniti seguiti da quelli dei profili
+int numPIDs = 0;
+
+bool decodePID(const PIDDescriptor& d, const String& payload, float& value);
+bool compileProfileEntry(String fields[5], PIDDescriptor& d);
+
+// Variabili assegnabili da profilo tramite il primo campo della riga
+struct ProfileTarget {
+  const char* name;
+  float* value;
+};
+
+ProfileTarget profileTargets[] = {
+  {"oilTemp", &oilTemp},
+  {"coolantTemp", &coolantTemp},
+  {"intakeTemp", &intakeTemp},
+  {"rpm", &rpm},
+  {"engineLoad", &engineLoad},
+  {"MAF", &MAF},
+  {"barometricPressure", &barometricPressure},
+};
+float profileValues[MAX_PIDS];  // Destinazione dei PID di profilo non mostrati a video
+
+enum ECUType : uint8_t { ECU_CAN_11BIT, ECU_CAN_29BIT, ECU_LEGACY };
+
+// Una voce per ogni ECU che ha risposto (CAN ID 0 = header disattivati, risposta anonima)
+struct ECUInfo {
+  uint32_t canId;          // CAN ID di risposta (es. 0x7E8 o 0x18DAF110), byte sorgente per ISO 9141/KWP/J1850
+  uint8_t type;            // ECUType
+  uint32_t supported[3];   // bitmap PID supportati 01-20, 21-40, 41-60
+  float values[MAX_PIDS];  // ultimo valore ricevuto da questa ECU per ogni PID della tabella
+};
+
+ECUInfo ecus[MAX_ECUS];
+int numECUs = 0;
+int pidOwner[MAX_PIDS];              // ECU a cui indirizzare ogni PID modo 01, -1 = nessuna
+bool pidActive[MAX_PIDS];            // false = escluso dalla schedulazione
+unsigned long pidLastPoll[MAX_PIDS];
+uint8_t pidMisses[MAX_PIDS];         // NO DATA consecutivi
+int lastRequestedPID = -1;
+unsigned long lastValidResponseTime = 0;
+bool pidDiscoveryDone = false;
+unsigned long lastDiscoveryTime = 0;
+uint32_t currentHeader = 0;     // header impostato con ATSH, 0 = broadcast di default (7DF / 18DB33F1)
+String vin = "";
+
 void setup() {
   M5.begin();
   M5.Lcd.setTextSize(2);
@@ -107,18 +262,37 @@ void setup() {
   //pinMode(ButtonA, INPUT);
   pinMode(ButtonB, INPUT);
   pinMode(ButtonC, INPUT);
+  resetPIDTable();
+  resetECUs();
   BTconnect();
   delay(1000);
-  ELMinit();
+  if (ELMinit()) {
+    identifyVehicle();
+  }
   delay(500);
  
   //attachInterrupt(digitalPinToInterrupt(ButtonA), indexUp, RISING); // Se il bluetooth è abilitato non è possibile utilizzare interrupt su GPIO39
   attachInterrupt(digitalPinToInterrupt(ButtonB), indexUp, RISING);
   attachInterrupt(digitalPinToInterrupt(ButtonC), indexDown, RISING);
+
+  M5.Lcd.setBrightness(BRIGHTNESS_RUNNING);
+  engineOffSince = millis();
+  lastAccountTime = millis();
 }
 
 void loop() {
- 
+  updatePowerStats();
+  updatePowerState();
+  if (powerState == POWER_PARKED) {
+    parkedCheck();
+    return;
+  }
+
+  // Avvio a quadro spento: si riprova il riconoscimento appena il bus risponde
+  if (!pidDiscoveryDone && lastValidResponseTime > lastDiscoveryTime && millis() - lastDiscoveryTime >= DISCOVERY_RETRY_INTERVAL) {
+    identifyVehicle();
+  }
+
   if(z>4) z=0;
   if(z<0) z=4;
 
@@ -135,6 +309,7 @@ void loop() {
     case 4: mafScreen(); break;
   }
  zLast = z;
+ idleUntilNextPoll();
 }
 
 void mainScreen(){
@@ -148,6 +323,9 @@ void mainScreen(){
 }
 
 void coolantScreen() {
+  unsigned long currentMillis = millis();
+  if (currentMillis - lastOBDQueryTime < OBDQueryInterval) return;
+  lastOBDQueryTime = currentMillis;
   int fontLCD = 3;
   static float lastCoolantTempMenu = -999.0;
   static float lastBarometricPressure = -999.0;
@@ -177,14 +355,10 @@ void coolantScreen() {
     firstMafScreen = true;
  }
   
-  sendOBDCommand(PID_COOLANT_TEMP);
-  handleOBDResponse();
-  sendOBDCommand(PID_ENGINE_LOAD);
-  handleOBDResponse();
-  sendOBDCommand(PID_AIR_INTAKE_TEMP);
-  handleOBDResponse();
-  sendOBDCommand(PID_MAF);
-  handleOBDResponse();
+  if (requestPID(PID_COOLANT_TEMP)) handleOBDResponse();
+  if (requestPID(PID_ENGINE_LOAD)) handleOBDResponse();
+  if (requestPID(PID_AIR_INTAKE_TEMP)) handleOBDResponse();
+  if (requestPID(PID_MAF)) handleOBDResponse();
 /*
   coolantTemp++;
   MAF++;
@@ -262,9 +436,11 @@ bool sendAndReadCommand(const char* cmd, String& response, int delayTime) {
   while (millis() - startTime < delayTime) {
     if (ELM_PORT.available()) {
       char c = ELM_PORT.read();
+      if (c == '>') break;  // Prompt: l'ELM327 ha terminato la risposta
       response += c;
+    } else {
+      delay(5); // Cede la CPU finché non arrivano dati
     }
-    delay(30); // Breve delay per non sovraccaricare la CPU
   }
   response.trim(); // Rimuove spazi bianchi
 
@@ -296,37 +472,43 @@ void sendOBDCommand(const char* cmd) {
 
 String bufferSerialData(int timeout, int numChars) {
     unsigned long startTime = millis();
-    while (millis() - startTime < timeout) {
+    bool prompt = false;
+    while (millis() - startTime < timeout && !prompt) {
         while (ELM_PORT.available()) {
             char c = ELM_PORT.read();
             writeToCircularBuffer(c);
+            if (c == '>') prompt = true;  // Risposta completa: inutile attendere il timeout
         }
-        delay(30); // Breve delay per non sovraccaricare la CPU
+        if (!prompt) delay(5); // Cede la CPU finché non arrivano dati
     }
     return readFromCircularBuffer(numChars);
 }
 
+// Ad ogni chiamata invia ATRV se scaduto, altrimenti il primo PID attivo il cui intervallo è scaduto
 void dataRequestOBD() {
-  static unsigned long lastCommandTime = 0;
   static int commandIndex = 0;
+  static bool lastWasVoltage = false;
   unsigned long currentMillis = millis();
 
-  const char* commands[] = {PID_COOLANT_TEMP, PID_AIR_INTAKE_TEMP, PID_RPM, PID_ENGINE_LOAD, PID_MAF};
-  int numCommands = sizeof(commands) / sizeof(commands[0]);
-
-  if (currentMillis - lastCommandTime >= OBDQueryInterval / numCommands) {
-    if (commandIndex < numCommands) {
-      sendOBDCommand(commands[commandIndex]);
-      delay(40);
-      commandIndex++;
-    } else {
-      commandIndex = 0;
-      if (millis() - lastVoltageQueryTime >= voltageQueryInterval) {
-        sendOBDCommand("ATRV");
-        lastVoltageQueryTime = millis();
+  // La tensione prende al massimo uno slot su due: non può bloccare i PID né esserne bloccata
+  if (!lastWasVoltage && currentMillis - lastVoltageQueryTime >= voltageQueryInterval) {
+    sendOBDCommand("ATRV");
+    lastRequestedPID = -1;
+    lastVoltageQueryTime = currentMillis;
+    lastWasVoltage = true;
+    return;
+  }
+  lastWasVoltage = false;
+
+  for (int n = 0; n < numPIDs; n++) {
+    int i = (commandIndex + n) % numPIDs;
+    if (pidActive[i] && currentMillis - pidLastPoll[i] >= pidTable[i].interval) {
+      if (requestDescriptor(i)) {
+        pidLastPoll[i] = currentMillis;
+        commandIndex = i + 1;
+        return;
       }
     }
-    lastCommandTime = currentMillis;
   }
 }
 
@@ -335,81 +517,727 @@ void handleOBDResponse() {
   parseOBDData(response);  // Parsing del buffer
 }
 
+// Divide la risposta dell'ELM327 in righe: con più ECU ogni riga è una risposta distinta
 void parseOBDData(const String& response) {
-  if (response.indexOf("4105") >= 0) {
-    coolantTemp = parseCoolantTemp(response);
+  String data = response;
+  data.replace('\n', '\r');
+  data.replace(">", "");
+  int start = 0;
+  while (start < data.length()) {
+    int end = data.indexOf('\r', start);
+    if (end < 0) end = data.length();
+    String line = data.substring(start, end);
+    line.replace(" ", "");
+    line.trim();
+    if (line.length() > 0) {
+      parseOBDLine(line);
+    }
+    start = end + 1;
   }
-   else if (response.indexOf("410C") >= 0) {
-    rpm = parseRPM(response);
+}
+
+// Decodifica una singola riga e la associa alla ECU che l'ha inviata
+void parseOBDLine(String line) {
+  if (line.endsWith("V") && isdigit(line.charAt(0))) {  // "12.6V", non l'eco "ATRV"
+    obdVoltage = parseOBDVoltage(line);
+    return;
   }
-   else if (response.indexOf("410F") >= 0) {
-    intakeTemp = parseIntakeTemp(response);
+  if (line == "NODATA") {
+    handleNoData();
+    return;
   }
-   else if (response.indexOf("V") >= 0) {
-    obdVoltage = parseOBDVoltage(response);
-  } 
-  else if (response.indexOf("4104") >= 0) {
-    engineLoad = parseEngineLoad(response);
+
+  int ecu = -1;
+  #ifdef USE_HEADERS
+    ecu = splitHeader(line);
+    if (ecu == ECU_TABLE_FULL) {
+      return;  // Mittente sconosciuto: come anonimo scavalcherebbe il filtro sulla ECU proprietaria
+    }
+  #endif
+  if (line.length() < 4) {
+    return;
+  }
+  if (line.startsWith("7F")) {
+    handleNegativeResponse(line);
+    return;
   }
-   else if (response.indexOf("4110") >= 0) {
-    MAF = parseMAF(response);
+
+  // Bitmap dei PID supportati (0100 / 0120 / 0140)
+  if (line.startsWith("4100") || line.startsWith("4120") || line.startsWith("4140")) {
+    byte pid = strtoul(line.substring(2, 4).c_str(), NULL, 16);
+    if (ecu < 0) ecu = findECU(0, ECU_CAN_11BIT);
+    if (ecu >= 0 && line.length() >= 12) {
+      ecus[ecu].supported[pid / 0x20] |= strtoul(line.substring(4, 12).c_str(), NULL, 16);
+    }
+    return;
   }
+
+  for (int i = 0; i < numPIDs; i++) {
+    float value;
+    if (!decodePID(pidTable[i], line, value)) continue;
+    if (ecu >= 0) {
+      ecus[ecu].values[i] = value;
+    }
+    // A video va solo il valore della ECU proprietaria del PID
+    if (ecu < 0 || pidOwner[i] < 0 || pidOwner[i] == ecu) {
+      *pidTable[i].value = value;
+    }
+    pidMisses[i] = 0;
+    lastValidResponseTime = millis();
+    return;
+  }
+}
+
+// Applica la formula del descrittore se la riga è la risposta al suo PID
+bool decodePID(const PIDDescriptor& d, const String& payload, float& value) {
+  char echo[8];
+  snprintf(echo, sizeof(echo), (d.mode == 0x01) ? "%02X%02X" : "%02X%04X", d.mode + 0x40, d.pid);
+  if (!payload.startsWith(echo)) return false;
+
+  int dataStart = strlen(echo);
+  bool twoBytes = (d.formula == FORMULA_AB || d.formula == FORMULA_SIGNED_AB);
+  if (payload.length() < dataStart + (twoBytes ? 4 : 2)) return false;
+
+  long raw = strtoul(payload.substring(dataStart, dataStart + (twoBytes ? 4 : 2)).c_str(), NULL, 16);
+  if (d.formula == FORMULA_SIGNED_A) raw = (int8_t)raw;
+  if (d.formula == FORMULA_SIGNED_AB) raw = (int16_t)raw;
+  value = raw * d.scale + d.offset;
+  return true;
+}
+
+// NO DATA ripetuti su un PID senza bitmap (modo 22) lo tolgono dalla schedulazione
+void handleNoData() {
+  // Conta solo se il bus risponde ad altri PID, altrimenti è il veicolo a essere spento
+  if (millis() - lastValidResponseTime > 2000) return;
+  countPIDMiss(false);
 }
 
-// Funzione per analizzare la temperatura del liquido di raffreddamento
-float parseCoolantTemp(const String& response) {
-  if (response.indexOf("4105") == 0) {
-    byte tempByte = strtoul(response.substring(4, 6).c_str(), NULL, 16);
-    return tempByte - 40;
+// Risposta negativa "7F <modo> <NRC>": la ECU è attiva ma rifiuta la richiesta
+void handleNegativeResponse(const String& line) {
+  if (lastRequestedPID < 0 || line.length() < 6) return;
+  byte mode = strtoul(line.substring(2, 4).c_str(), NULL, 16);
+  byte nrc = strtoul(line.substring(4, 6).c_str(), NULL, 16);
+  if (mode != pidTable[lastRequestedPID].mode || nrc == 0x78) return;  // 0x78: risposta in arrivo
+  // 0x11 servizio, 0x12 funzione, 0x31 DID non supportati: inutile riprovare
+  countPIDMiss(nrc == 0x11 || nrc == 0x12 || nrc == 0x31);
+}
+
+void countPIDMiss(bool unsupported) {
+  if (lastRequestedPID < 0 || pidTable[lastRequestedPID].mode == 0x01) return;
+  if (unsupported) pidMisses[lastRequestedPID] = MAX_PID_MISSES;
+  else pidMisses[lastRequestedPID]++;
+  if (pidMisses[lastRequestedPID] >= MAX_PID_MISSES) {
+    pidActive[lastRequestedPID] = false;
+    #ifdef DEBUG
+      Serial.printf("PID %02X%04X rimosso: non supportato\n", pidTable[lastRequestedPID].mode, pidTable[lastRequestedPID].pid);
+    #endif
   }
-  return lastCoolantTemp;
 }
 
-// Funzione per analizzare la temperatura dell'aria di aspirazione
-float parseIntakeTemp(const String& response) {
-  if (response.indexOf("410F") == 0) {
-    byte tempByte = strtoul(response.substring(4, 6).c_str(), NULL, 16);
-    return tempByte - 40;
+// Vero se un PID schedulato aggiorna la variabile (es. oilTemp solo con un profilo che la fornisce)
+bool isTargetActive(float* value) {
+  for (int i = 0; i < numPIDs; i++) {
+    if (pidActive[i] && pidTable[i].value == value) return true;
   }
-  return lastIntakeTemp;
+  return false;
 }
 
-// Funzione per analizzare i giri del motore (RPM)
-float parseRPM(const String& response) {
-  if (response.indexOf("410C") == 0) {
-    byte highByte = strtoul(response.substring(4, 6).c_str(), NULL, 16);
-    byte lowByte = strtoul(response.substring(6, 8).c_str(), NULL, 16);
-    return (highByte * 256 + lowByte) / 4;
+// Rimuove header e byte PCI/checksum dalla riga; ritorna l'indice della ECU, -1 se la riga non ha header
+// o ECU_TABLE_FULL se le MAX_ECUS voci sono già occupate da altre ECU
+int splitHeader(String& line) {
+  for (int i = 0; i < line.length(); i++) {
+    if (!isxdigit(line.charAt(i))) return -1;  // NO DATA, SEARCHING..., ecc.
   }
-  return 0.0;
+
+  int headerLen;
+  uint8_t type;
+  if (line.startsWith("18DA") && line.length() >= 12) {
+    headerLen = 8;  // ID a 29 bit: 18 DA F1 xx
+    type = ECU_CAN_29BIT;
+  } else if (line.charAt(0) == '7' && line.length() >= 7) {
+    headerLen = 3;  // ID a 11 bit: 7E8..7EF
+    type = ECU_CAN_11BIT;
+  } else {
+    // ISO 9141 / J1850 (48 6B xx, 41 6B xx) e KWP (8x / Cx F1 xx): 3 byte di header, checksum in coda
+    byte format = strtoul(line.substring(0, 2).c_str(), NULL, 16);
+    bool legacy = format == 0x48 || format == 0x41 || (format & 0xC0) == 0x80 || (format & 0xC0) == 0xC0;
+    if (!legacy || line.length() < 12 || line.length() % 2 != 0) return -1;
+    uint32_t source = strtoul(line.substring(4, 6).c_str(), NULL, 16);
+    line = line.substring(6, line.length() - 2);
+    int ecu = findECU(source, ECU_LEGACY);
+    return (ecu < 0) ? ECU_TABLE_FULL : ecu;
+  }
+
+  uint32_t canId = strtoul(line.substring(0, headerLen).c_str(), NULL, 16);
+  byte pci = strtoul(line.substring(headerLen, headerLen + 2).c_str(), NULL, 16);
+  if (pci == 0 || pci > 7) {
+    line = "";  // Non è un single frame: i messaggi multi-frame non sono gestiti qui
+    return -1;
+  }
+  line = line.substring(headerLen + 2, headerLen + 2 + pci * 2);
+  int ecu = findECU(canId, type);
+  return (ecu < 0) ? ECU_TABLE_FULL : ecu;
 }
 
-// Funzione per analizzare il carico del motore
-float parseEngineLoad(const String& response) {
-  if (response.indexOf("4104") == 0) {
-    byte loadByte = strtoul(response.substring(4, 6).c_str(), NULL, 16);
-    return (loadByte * 100.0) / 255.0;
+int findECU(uint32_t canId, uint8_t type) {
+  for (int i = 0; i < numECUs; i++) {
+    if (ecus[i].canId == canId) return i;
   }
-  return 0.0;
+  if (numECUs >= MAX_ECUS) return -1;
+
+  ECUInfo& ecu = ecus[numECUs];
+  ecu.canId = canId;
+  ecu.type = type;
+  for (int i = 0; i < 3; i++) ecu.supported[i] = 0;
+  for (int i = 0; i < MAX_PIDS; i++) ecu.values[i] = 0.0;
+  return numECUs++;
 }
 
-// Funzione per analizzare il flusso di massa d'aria (MAF)
-float parseMAF(const String& response) {
-  if (response.indexOf("4110") == 0) {
-    int A = strtoul(response.substring(4, 6).c_str(), NULL, 16);
-    int B = strtoul(response.substring(6, 8).c_str(), NULL, 16);
-    return ((A * 256) + B) / 100.0;
+// Dimentica le ECU riconosciute: nessun PID ha una ECU proprietaria finché la ricerca non riesce
+void resetECUs() {
+  numECUs = 0;
+  pidDiscoveryDone = false;
+  for (int i = 0; i < MAX_PIDS; i++) {
+    pidOwner[i] = -1;
+    pidActive[i] = (i < NUM_BUILTIN_PIDS);
+    pidMisses[i] = 0;
   }
-  return 0.0;
 }
 
-// Funzione per analizzare la pressione barometrica
-float parseBarometricPressure(const String& response) {
-  if (response.indexOf("4133") == 0) {
-    byte pressureByte = strtoul(response.substring(4, 6).c_str(), NULL, 16);
-    return pressureByte;
+// Riparte dai soli PID predefiniti: i profili vengono ricaricati in coda
+void resetPIDTable() {
+  for (int i = 0; i < NUM_BUILTIN_PIDS; i++) {
+    pidTable[i] = builtinPIDs[i];
   }
-  return 0.0;
+  numPIDs = NUM_BUILTIN_PIDS;
+}
+
+// VIN, profilo e PID supportati; ripetuto finché nessuna ECU risponde (es. avvio a quadro spento)
+void identifyVehicle() {
+  resetECUs();
+  resetPIDTable();
+  vin = readVIN();
+  #ifdef DEBUG
+    displayDebugMessage(vin.length() > 0 ? vin.c_str() : "VIN non disponibile", 0, 200, WHITE);
+  #endif
+  loadVehicleProfile();
+  discoverSupportedPIDs();
+  lastDiscoveryTime = millis();
+}
+
+// Cerca il descrittore di un comando nel formato "0105" o "221310"
+int findPID(const char* cmd) {
+  uint32_t request = strtoul(cmd, NULL, 16);
+  for (int i = 0; i < numPIDs; i++) {
+    int pidBits = (pidTable[i].mode == 0x01) ? 8 : 16;
+    if (request == (((uint32_t)pidTable[i].mode << pidBits) | pidTable[i].pid)) return i;
+  }
+  return -1;
+}
+
+bool isPIDSupported(int ecu, byte pid) {
+  if (pid == 0 || pid > 0x60) return false;
+  int bit = (pid - 1) % 32;
+  return (ecus[ecu].supported[(pid - 1) / 32] >> (31 - bit)) & 1;
+}
+
+// Legge le bitmap 0100/0120/0140 da tutte le ECU che rispondono e assegna i PID
+void discoverSupportedPIDs() {
+  String response;
+  const char* bitmapCmds[] = {PID_SUPPORTED_01_20, PID_SUPPORTED_21_40, PID_SUPPORTED_41_60};
+
+  #ifdef DEBUG
+    displayDebugMessage("Ricerca PID...", 0, 200, WHITE);
+  #endif
+
+  if (vin.length() > 0 && loadPIDCache()) {
+    #ifdef DEBUG
+      displayDebugMessage("PID da cache SD", 0, 200, WHITE);
+    #endif
+  } else {
+    for (int i = 0; i < 3; i++) {
+      if (i > 0) {
+        // La bitmap successiva esiste solo se l'ultimo bit della precedente è attivo
+        bool next = false;
+        for (int e = 0; e < numECUs; e++) {
+          if (isPIDSupported(e, i * 0x20)) next = true;
+        }
+        if (!next) break;
+      }
+      if (sendAndReadCommand(bitmapCmds[i], response, 1000)) {
+        parseOBDData(response);
+      }
+    }
+    if (numECUs > 0 && vin.length() > 0) {
+      savePIDCache();
+    }
+  }
+
+  if (numECUs == 0) {
+    #ifdef DEBUG
+      displayDebugMessage("Nessuna ECU", 0, 200, RED);
+    #endif
+    return;  // Senza bitmap si continua a interrogare tutti i PID in broadcast
+  }
+  assignPIDOwners();
+  pidDiscoveryDone = true;
+}
+
+// Ogni PID viene richiesto solo alla ECU con CAN ID più basso che lo supporta (di solito il motore)
+void assignPIDOwners() {
+  for (int i = 0; i < numPIDs; i++) {
+    pidOwner[i] = -1;
+    if (pidTable[i].mode != 0x01) continue;  // Modo 22: nessuna bitmap, resta attivo finché risponde
+    for (int e = 0; e < numECUs; e++) {
+      if (isPIDSupported(e, pidTable[i].pid) && (pidOwner[i] < 0 || ecus[e].canId < ecus[pidOwner[i]].canId)) {
+        pidOwner[i] = e;
+      }
+    }
+    pidActive[i] = (pidOwner[i] >= 0);
+    #ifdef DEBUG
+      Serial.printf("PID %02X%02X -> ECU %lX\n", pidTable[i].mode, pidTable[i].pid, pidOwner[i] >= 0 ? (unsigned long)ecus[pidOwner[i]].canId : 0UL);
+    #endif
+  }
+}
+
+// Header di richiesta fisica della ECU: 7E8 -> 7E0, 18DAF1xx -> DAxxF1 (priorità 18 di default)
+uint32_t requestHeaderFor(int ecu) {
+  // ECU anonima o non CAN: resta il broadcast
+  if (ecus[ecu].canId == 0 || ecus[ecu].type == ECU_LEGACY) return 0;
+  return (ecus[ecu].type == ECU_CAN_29BIT) ? (0xDA00F1 | ((ecus[ecu].canId & 0xFF) << 8)) : ecus[ecu].canId - 8;
+}
+
+// Indirizza le richieste successive all'header indicato (ATSH), 0 = broadcast
+void setRequestHeader(uint32_t header) {
+  if (header == currentHeader) return;
+
+  bool extendedBus = false;
+  for (int e = 0; e < numECUs; e++) {
+    if (ecus[e].type == ECU_CAN_29BIT) extendedBus = true;
+  }
+  uint32_t sent = header ? header : (extendedBus ? 0xDB33F1 : 0x7DF);
+
+  char cmd[16];
+  snprintf(cmd, sizeof(cmd), (sent > 0xFFF) ? "ATSH%06lX" : "ATSH%03lX", (unsigned long)sent);
+  String response;
+  if (sendAndReadCommand(cmd, response, 200)) {
+    currentHeader = header;
+  }
+}
+
+// Invia la richiesta di un descrittore; ritorna false se il PID è stato escluso dalla schedulazione
+bool requestDescriptor(int i) {
+  if (!pidActive[i]) return false;
+
+  const PIDDescriptor& d = pidTable[i];
+  uint32_t header = d.header;
+  if (header == 0 && pidOwner[i] >= 0) {
+    #ifdef USE_HEADERS
+      header = requestHeaderFor(pidOwner[i]);
+    #endif
+  }
+  setRequestHeader(header);
+
+  char cmd[12];
+  snprintf(cmd, sizeof(cmd), (d.mode == 0x01) ? "%02X%02X" : "%02X%04X", d.mode, d.pid);
+  if (header != 0) {
+    strcat(cmd, "1");  // Una sola risposta attesa: l'ELM327 risponde senza attendere il timeout
+  }
+  sendOBDCommand(cmd);
+  lastRequestedPID = i;
+  return true;
+}
+
+bool requestPID(const char* cmd) {
+  int i = findPID(cmd);
+  if (i < 0) {
+    sendOBDCommand(cmd);
+    lastRequestedPID = -1;
+    return true;
+  }
+  return requestDescriptor(i);
+}
+
+// Legge il VIN (0902) con gli header disattivati per avere il payload ISO-TP già riassemblato
+String readVIN() {
+  String response;
+  #ifdef USE_HEADERS
+    sendAndReadCommand("ATH0", response, 200);
+  #endif
+  sendAndReadCommand("0902", response, 5000);  // Prima richiesta OBD: include la ricerca del protocollo
+  #ifdef USE_HEADERS
+    String headerResponse;
+    sendAndReadCommand("ATH1", headerResponse, 200);
+  #endif
+
+  // CAN: "014\r0:490201xxxx\r1:xxxx...", altri protocolli: "490201xx\r490202xx..."
+  String hex = "";
+  response.replace('\n', '\r');
+  int start = 0;
+  while (start < response.length()) {
+    int end = response.indexOf('\r', start);
+    if (end < 0) end = response.length();
+    String line = response.substring(start, end);
+    line.replace(" ", "");
+    line.trim();
+    int colon = line.indexOf(':');
+    if (colon >= 0) {
+      hex += line.substring(colon + 1);
+    } else if (line.startsWith("4902")) {
+      hex += (hex.length() == 0) ? line : line.substring(6);
+    }
+    start = end + 1;
+  }
+
+  int vinStart = hex.indexOf("4902");
+  if (vinStart < 0) return "";
+  String result = "";
+  for (int i = vinStart + 6; i + 1 < hex.length(); i += 2) {
+    char c = strtoul(hex.substring(i, i + 2).c_str(), NULL, 16);
+    if (isalnum(c)) result += c;
+  }
+  if (result.length() < 17) return "";
+  return result.substring(result.length() - 17);
+}
+
+// Cache delle bitmap per VIN: una riga "canId tipo bitmap01 bitmap21 bitmap41" per ECU
+bool loadPIDCache() {
+  File file = SD.open(String(PID_CACHE_DIR "/") + vin + ".pid", FILE_READ);
+  if (!file) return false;
+  while (file.available()) {
+    String line = file.readStringUntil('\n');
+    line.trim();
+    uint32_t canId, bitmap[3];
+    int type;
+    if (sscanf(line.c_str(), "%lx %d %lx %lx %lx", (unsigned long*)&canId, &type, (unsigned long*)&bitmap[0], (unsigned long*)&bitmap[1], (unsigned long*)&bitmap[2]) != 5) continue;
+    int ecu = findECU(canId, type);
+    if (ecu < 0) continue;
+    for (int b = 0; b < 3; b++) ecus[ecu].supported[b] = bitmap[b];
+  }
+  file.close();
+  return numECUs > 0;
+}
+
+void savePIDCache() {
+  if (!SD.exists(PID_CACHE_DIR)) SD.mkdir(PID_CACHE_DIR);
+  File file = SD.open(String(PID_CACHE_DIR "/") + vin + ".pid", FILE_WRITE);
+  if (!file) return;
+  for (int e = 0; e < numECUs; e++) {
+    file.printf("%lX %d %08lX %08lX %08lX\n", (unsigned long)ecus[e].canId, ecus[e].type,
+                (unsigned long)ecus[e].supported[0], (unsigned long)ecus[e].supported[1], (unsigned long)ecus[e].supported[2]);
+  }
+  file.close();
+}
+
+// Carica il profilo del veicolo (per VIN, altrimenti default.csv). Una riga per PID:
+//   destinazione,header,richiesta,formula,intervallo_ms   es. oilTemp,7E0,221310,A-40,1000
+// formula: A, AB, SA o SAB (con segno) seguita da operazioni *k /k +k -k applicate in ordine
+void loadVehicleProfile() {
+  File file = SD.open(String(PROFILE_DIR "/") + vin + ".csv", FILE_READ);
+  if (!file) file = SD.open(PROFILE_DIR "/default.csv", FILE_READ);
+  if (!file) return;
+
+  while (file.available() && numPIDs < MAX_PIDS) {
+    String line = file.readStringUntil('\n');
+    line.trim();
+    if (line.length() == 0 || line.startsWith("#")) continue;
+
+    String fields[5];
+    int start = 0;
+    for (int f = 0; f < 5; f++) {
+      int end = line.indexOf(',', start);
+      if (end < 0) end = line.length();
+      fields[f] = line.substring(start, end);
+      fields[f].trim();
+      start = end + 1;
+    }
+
+    PIDDescriptor d;
+    if (!compileProfileEntry(fields, d)) {
+      #ifdef DEBUG
+        Serial.println("Profilo, riga non valida: " + line);
+      #endif
+      continue;
+    }
+    pidTable[numPIDs] = d;
+    pidOwner[numPIDs] = -1;
+    pidActive[numPIDs] = true;
+    numPIDs++;
+  }
+  file.close();
+}
+
+// Converte una riga del profilo nello stesso descrittore dei PID predefiniti
+bool compileProfileEntry(String fields[5], PIDDescriptor& d) {
+  String request = fields[2];
+  if (request.length() != 4 && request.length() != 6) return false;
+  d.mode = strtoul(request.substring(0, 2).c_str(), NULL, 16);
+  d.pid = strtoul(request.substring(2).c_str(), NULL, 16);
+  // Modo 01: PID a 8 bit, modo 22: DID a 16 bit; altri modi non sono gestiti da decodePID
+  if (d.mode == 0x01 && request.length() != 4) return false;
+  if (d.mode == 0x22 && request.length() != 6) return false;
+  if (d.mode != 0x01 && d.mode != 0x22) return false;
+  d.header = strtoul(fields[1].c_str(), NULL, 16);
+  d.interval = fields[4].toInt();
+  if (d.interval == 0) d.interval = 1000;
+
+  String formula = fields[3];
+  formula.toUpperCase();
+  int pos;
+  if (formula.startsWith("SAB")) { d.formula = FORMULA_SIGNED_AB; pos = 3; }
+  else if (formula.startsWith("SA")) { d.formula = FORMULA_SIGNED_A; pos = 2; }
+  else if (formula.startsWith("AB")) { d.formula = FORMULA_AB; pos = 2; }
+  else if (formula.startsWith("A")) { d.formula = FORMULA_A; pos = 1; }
+  else return false;
+
+  d.scale = 1.0;
+  d.offset = 0.0;
+  while (pos < formula.length()) {
+    char op = formula.charAt(pos);
+    int next = pos + 1;
+    while (next < formula.length() && String("*/+-").indexOf(formula.charAt(next)) < 0) next++;
+    float k = formula.substring(pos + 1, next).toFloat();
+    switch (op) {
+      case '*': d.scale *= k; d.offset *= k; break;
+      case '/': if (k == 0) return false; d.scale /= k; d.offset /= k; break;
+      case '+': d.offset += k; break;
+      case '-': d.offset -= k; break;
+      default: return false;
+    }
+    pos = next;
+  }
+
+  d.value = NULL;
+  for (int i = 0; i < sizeof(profileTargets) / sizeof(profileTargets[0]); i++) {
+    if (fields[0] == profileTargets[i].name) d.value = profileTargets[i].value;
+  }
+  if (d.value == NULL) d.value = &profileValues[numPIDs];  // Solo registrato per ECU / seriale
+  return true;
+}
+
+// Stato del veicolo da tensione e RPM: motore acceso (o alternatore in carica), quadro acceso, parcheggiato
+void updatePowerState() {
+  unsigned long now = millis();
+
+  if (powerState == POWER_PARKED) {
+    return;  // Tensione e ripresa gestite da parkedCheck(), l'ELM327 è in low power
+  }
+
+  // Fuori dalla schermata principale la tensione non viene letta dallo scheduler
+  if (now - lastVoltageQueryTime >= VOLTAGE_STALE_TIME) {
+    sendOBDCommand("ATRV");
+    lastRequestedPID = -1;
+    lastVoltageQueryTime = now;
+    handleOBDResponse();
+  }
+
+  // A motore spento l'RPM si legge comunque, per riconoscere la ripartenza anche con alternatore "smart"
+  if (powerState == POWER_ENGINE_OFF && now - lastRPMCheckTime >= ENGINE_OFF_RPM_INTERVAL) {
+    lastRPMCheckTime = now;
+    if (requestPID(PID_RPM)) handleOBDResponse();
+  }
+
+  bool engineOn = obdVoltage >= CHARGING_VOLTAGE || (rpm > 0 && now - lastValidResponseTime < ENGINE_DATA_TIMEOUT);
+  if (engineOn) {
+    engineOffSince = now;
+  }
+
+  switch (powerState) {
+    case POWER_RUNNING:
+      if (!engineOn && now - engineOffSince >= ENGINE_OFF_DELAY) setPowerState(POWER_ENGINE_OFF);
+      break;
+    case POWER_ENGINE_OFF:
+      if (engineOn) setPowerState(POWER_RUNNING);
+      else if (now - engineOffSince >= PARK_DELAY) setPowerState(POWER_PARKED);
+      break;
+    case POWER_PARKED:
+      break;  // Gestito da parkedCheck()
+  }
+}
+
+void setPowerState(PowerState state) {
+  String response;
+  switch (state) {
+    case POWER_RUNNING:
+      setCpuFrequencyMhz(240);
+      if (powerState == POWER_PARKED) {
+        M5.Lcd.wakeup();
+        if (!ELM_PORT.connected()) BTconnect();
+        if (elmStandby) ELMwake();
+        // L'ELM327 esce dallo standby con un warm start: si ripristinano ATE0/ATS0/ATH1...
+        if (!ELMrestore()) ELMinit();
+        currentHeader = 0;
+        elmLowPower = false;
+        firstMainScreen = firstCoolantScreen = firstEngineScreen = firstBarScreen = firstMafScreen = true;
+        zLast = -1;         // Ridisegna la schermata corrente
+      }
+      M5.Lcd.setBrightness(BRIGHTNESS_RUNNING);
+      OBDQueryInterval = RUNNING_QUERY_INTERVAL;
+      engineOffSince = millis();
+      break;
+    case POWER_ENGINE_OFF:
+      setCpuFrequencyMhz(80);  // Minimo compatibile con il Bluetooth
+      M5.Lcd.setBrightness(BRIGHTNESS_ENGINE_OFF);
+      OBDQueryInterval = ENGINE_OFF_QUERY_INTERVAL;
+      break;
+    case POWER_PARKED:
+      parkedVoltage = obdVoltage;
+      ELMstandby();
+      M5.Lcd.setBrightness(0);
+      M5.Lcd.sleep();
+      break;
+  }
+  powerState = state;
+  #ifdef DEBUG
+    Serial.printf("Power state %d, %.2f V\n", state, obdVoltage);
+  #endif
+}
+
+// Da parcheggiato: ELM327 in standby e BT spento, l'ESP32 resta in light sleep per PARKED_WAKE_INTERVAL,
+// poi riconnette, risveglia l'ELM327 e rilegge la tensione. La ripresa da pulsante è immediata (risveglio GPIO),
+// quella da tensione avviene entro PARKED_WAKE_INTERVAL più la riconnessione BT.
+void parkedCheck() {
+  String response;
+
+  // Fino a ATLP_ENTRY_DELAY dopo l'OK l'ELM327 è ancora attivo e come tale viene contabilizzato
+  bool buttonWake = lightSleep(ATLP_ENTRY_DELAY);
+  if (!buttonWake) {
+    elmLowPower = elmStandby;
+    buttonWake = lightSleep(PARKED_WAKE_INTERVAL - ATLP_ENTRY_DELAY);
+  }
+  updatePowerStats();
+  elmLowPower = false;  // Da qui l'ELM327 viene risvegliato
+
+  // Pulsanti premuti: ripresa immediata
+  if (buttonWake || z != zLast || digitalRead(ButtonB) == LOW || digitalRead(ButtonC) == LOW) {
+    setPowerState(POWER_RUNNING);
+    return;
+  }
+
+  if (!BTconnect()) {
+    ELM_PORT.end();  // ELM327 spento o irraggiungibile: si riprova al prossimo ciclo
+    return;
+  }
+  ELMwake();
+  if (!ELMrestore()) {
+    ELMstandby();
+    return;
+  }
+  if (sendAndReadCommand("ATRV", response, PARKED_ATRV_TIMEOUT)) {
+    parseOBDData(response);
+  }
+  lastVoltageQueryTime = millis();
+  if (obdVoltage > 0 && obdVoltage < parkedVoltage) {
+    parkedVoltage = obdVoltage;  // La ripresa si misura dalla tensione minima a riposo
+  }
+
+  if (obdVoltage >= CHARGING_VOLTAGE || obdVoltage - parkedVoltage >= WAKE_VOLTAGE_RISE) {
+    setPowerState(POWER_RUNNING);
+    return;
+  }
+  ELMstandby();
+}
+
+// ATLP e chiusura del BT: il BT classico non mantiene il link in light sleep, quindi si spegne del tutto
+void ELMstandby() {
+  String response;
+  elmStandby = sendAndReadCommand("ATLP", response, 200) && response.indexOf("OK") >= 0;
+  ELM_PORT.end();
+}
+
+// Uno spazio risveglia l'ELM327 dallo standby; se fosse già sveglio viene ignorato, mentre un CR
+// ripeterebbe l'ultimo comando (ATLP). Si scarta il messaggio del warm start.
+void ELMwake() {
+  ELM_PORT.print(" ");
+  delay(ELM_WAKE_DELAY);
+  while (ELM_PORT.available()) ELM_PORT.read();
+  elmStandby = false;
+}
+
+// Light sleep con risveglio a tempo o dai pulsanti B/C; ritorna true se svegliato da un pulsante
+bool lightSleep(unsigned long ms) {
+  // Gli interrupt RISING non funzionano in sleep: si usa il livello basso come sorgente di risveglio
+  detachInterrupt(digitalPinToInterrupt(ButtonB));
+  detachInterrupt(digitalPinToInterrupt(ButtonC));
+  gpio_wakeup_enable(ButtonB, GPIO_INTR_LOW_LEVEL);
+  gpio_wakeup_enable(ButtonC, GPIO_INTR_LOW_LEVEL);
+  esp_sleep_enable_gpio_wakeup();
+  esp_sleep_enable_timer_wakeup(ms * 1000ULL);
+
+  unsigned long start = millis();
+  esp_light_sleep_start();
+  unsigned long slept = millis() - start;
+  bool buttonWake = esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_GPIO;
+
+  gpio_wakeup_disable(ButtonB);
+  gpio_wakeup_disable(ButtonC);
+  attachInterrupt(digitalPinToInterrupt(ButtonB), indexUp, RISING);
+  attachInterrupt(digitalPinToInterrupt(ButtonC), indexDown, RISING);
+
+  accountCurrent(estimateCurrent(true), slept);
+  sleptSinceAccount += slept;
+  return buttonWake;
+}
+
+// Attende la prossima richiesta della schermata corrente senza far girare loop() a vuoto
+void idleUntilNextPoll() {
+  unsigned long elapsed = millis() - lastOBDQueryTime;
+  if (z == zLast && elapsed < OBDQueryInterval) {
+    delay(OBDQueryInterval - elapsed);
+  }
+}
+
+// Stima della corrente assorbita a 12 V: M5Stack (alimentato via USB) + ELM327
+float estimateCurrent(bool asleep) {
+  float esp;
+  if (asleep) esp = CURRENT_ESP_LIGHT_SLEEP;
+  else esp = (getCpuFrequencyMhz() <= 80) ? CURRENT_ESP_80MHZ : CURRENT_ESP_240MHZ;
+  float backlight = (powerState == POWER_PARKED) ? 0.0 :
+                    CURRENT_BACKLIGHT_MAX * ((powerState == POWER_RUNNING) ? BRIGHTNESS_RUNNING : BRIGHTNESS_ENGINE_OFF) / 255.0;
+  float elm = elmLowPower ? CURRENT_ELM_LOW_POWER : CURRENT_ELM_ACTIVE;
+  return (esp + backlight) * USB_TO_12V_FACTOR + elm;
+}
+
+void accountCurrent(float mA, unsigned long ms) {
+  windowCharge += (double)mA * ms;
+  windowTime += ms;
+  totalCharge += (double)mA * ms;  // double: dopo ore da parcheggiato un float non accumulerebbe più
+  totalTime += ms;
+}
+
+// Chiamata ad ogni loop: contabilizza il tempo da sveglio e chiude la finestra di media
+void updatePowerStats() {
+  unsigned long now = millis();
+  unsigned long awake = now - lastAccountTime;
+  awake = (awake > sleptSinceAccount) ? awake - sleptSinceAccount : 0;
+  accountCurrent(estimateCurrent(false), awake);
+  sleptSinceAccount = 0;
+  lastAccountTime = now;
+
+  if (windowTime >= POWER_STATS_WINDOW) {
+    averageCurrent = windowCharge / windowTime;
+    windowCharge = 0;
+    windowTime = 0;
+    #ifdef DEBUG
+      Serial.printf("Corrente media: %.1f mA (da avvio %.1f mA)\n", averageCurrent, totalCharge / totalTime);
+    #endif
+  }
+}
+
+// Ripristina le impostazioni dopo il warm start di uscita dal low power, senza ATZ né ricerca protocollo
+bool ELMrestore() {
+  String response;
+  const char* settings[] = {"ATE0", "ATL0", "ATS0", "ATST0A",
+  #ifdef USE_HEADERS
+    "ATH1",
+  #endif
+  };
+  for (int i = 0; i < sizeof(settings) / sizeof(settings[0]); i++) {
+    if (!sendAndReadCommand(settings[i], response, 200) || response.indexOf("OK") < 0) {
+      return false;
+    }
+  }
+  return true;
 }
 
 // Funzione per analizzare la tensione OBD
@@ -437,6 +1265,7 @@ void updateDisplay() {
   static float lastIntakeTemp = -999.0;
   static float lastEngineLoad = -999.0;
   static float lastMAF = -999.0;
+  static float lastCurrent = -999.0;
   
   if (firstMainScreen){
      M5.Lcd.fillScreen(BLACK);
@@ -499,9 +1328,29 @@ void updateDisplay() {
     M5.Lcd.printf("MAF: %.1f%%\n", MAF);
     lastMAF = MAF;
   }
+
+  if (oilTemp != lastOilTemp && isTargetActive(&oilTemp)) {
+    M5.Lcd.fillRect(0, 120, 320, 20, BLACK);  // Aggiorna solo la parte della temperatura olio (PID da profilo)
+    M5.Lcd.setCursor(0, 120);
+    M5.Lcd.setTextColor(WHITE);
+    M5.Lcd.printf("Oil Temp: %.1f C\n", oilTemp);
+    lastOilTemp = oilTemp;
+  }
+
+  if (averageCurrent != lastCurrent) {
+    M5.Lcd.fillRect(0, 140, 320, 15, BLACK);  // Aggiorna solo la parte della corrente media stimata
+    M5.Lcd.setCursor(0, 140);
+    M5.Lcd.setTextColor(LIGHTGREY);
+    M5.Lcd.printf("Current: %.0f mA\n", averageCurrent);
+    lastCurrent = averageCurrent;
+  }
 }
 
 void displayDebugMessage(const char* message, int x , int y, uint16_t textColour) {
+  if (powerState == POWER_PARKED) {
+    Serial.println(message);  // LCD in sleep: solo monitor seriale
+    return;
+  }
   M5.Lcd.setTextColor(textColour);
   M5.Lcd.fillRect(x, y, 320, 40, BLACK);  // Pulisce la parte bassa del display
   M5.Lcd.setCursor(x, y);
@@ -576,6 +1425,18 @@ bool ELMinit() {
     displayDebugMessage(response.c_str(), 0 , 120, WHITE);
   #endif
 
+  #ifdef USE_HEADERS
+  if (!sendAndReadCommand("ATH1", response, 1500)) {  // Header CAN visibili per distinguere le ECU
+    #ifdef DEBUG
+      displayDebugMessage("Err ATH1", 0 , 140, WHITE);
+    #endif
+    return false;
+  }
+  #ifdef DEBUG
+    displayDebugMessage(response.c_str(), 0 , 140, WHITE);
+  #endif
+  #endif
+
   return true;
 }
 
@@ -604,9 +1465,10 @@ String readFromCircularBuffer(int numChars) {
 }
 
 void rpmScreen() {
-  sendOBDCommand(PID_RPM);
-  delay(20);
-  handleOBDResponse();
+  if (requestPID(PID_RPM)) {
+    delay(20);
+    handleOBDResponse();
+  }
   M5.Lcd.fillScreen(BLACK);
   M5.Lcd.setTextSize(3);
   M5.Lcd.setTextColor(WHITE);
@@ -615,9 +1477,13 @@ void rpmScreen() {
 }
 
 void engineLoadScreen() {
-  sendOBDCommand(PID_ENGINE_LOAD);
-  delay(20);
-  handleOBDResponse();
+  unsigned long currentMillis = millis();
+  if (currentMillis - lastOBDQueryTime < OBDQueryInterval) return;
+  lastOBDQueryTime = currentMillis;
+  if (requestPID(PID_ENGINE_LOAD)) {
+    delay(20);
+    handleOBDResponse();
+  }
   if(firstEngineScreen){
     M5.Lcd.fillScreen(BLACK);
     firstMainScreen = true;
@@ -633,9 +1499,13 @@ void engineLoadScreen() {
 }
 
 void mafScreen() {
-  sendOBDCommand(PID_MAF);
-  delay(20);
-  handleOBDResponse();
+  unsigned long currentMillis = millis();
+  if (currentMillis - lastOBDQueryTime < OBDQueryInterval) return;
+  lastOBDQueryTime = currentMillis;
+  if (requestPID(PID_MAF)) {
+    delay(20);
+    handleOBDResponse();
+  }
 
   if(firstMafScreen){
      M5.Lcd.fillScreen(BLACK);
@@ -652,9 +1522,13 @@ void mafScreen() {
 }
 
 void barometricScreen() {
-  sendOBDCommand(PID_BAROMETRIC_PRESSURE);
-  delay(20);
-  handleOBDResponse();
+  unsigned long currentMillis = millis();
+  if (currentMillis - lastOBDQueryTime < OBDQueryInterval) return;
+  lastOBDQueryTime = currentMillis;
+  if (requestPID(PID_BAROMETRIC_PRESSURE)) {
+    delay(20);
+    handleOBDResponse();
+  }
   if(firstBarScreen){
     M5.Lcd.fillScreen(DARKGREY);
     firstMainScreen = true;